@@ -0,0 +1,351 @@
+/**
+ * @file pm_guard.c
+ * @author Edgar Alan David and Stephano Barrios-Pompei
+ * @brief Sampling guard-page allocator for catching heap memory errors in
+ * production. Roughly 1 in PM_GUARD_SAMPLE_RATE (environment variable,
+ * default 5000, 0 disables) allocations are served from a separate pool in
+ * which every slot sits between two PROT_NONE guard pages:
+ *
+ *   | guard | slot 0 | guard | slot 1 | guard | ... | slot N-1 | guard |
+ *
+ * Objects are placed at the end of their slot, so running off the end faults
+ * on the next guard page. Freed slots are made inaccessible and only reused
+ * once every other free slot has been, so a use after free faults too. On a
+ * fault the allocation and free stack traces of the slot are printed.
+ * @version 0.1
+ * @date 2022-11-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#define _GNU_SOURCE
+#include <execinfo.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
+
+#include "practicum1.h"
+
+/******************************
+ ******MACROS AND STRUCTS******
+ ******************************/
+#define GUARD_DEFAULT_SAMPLE_RATE 5000
+#define GUARD_MIN_ALIGNMENT 16  // alignment of a sampled pm_malloc object
+#define GUARD_TRACE_DEPTH 16
+
+typedef struct guard_slot {
+  void* alloc_trace[GUARD_TRACE_DEPTH];  // stack of the allocating call
+  void* free_trace[GUARD_TRACE_DEPTH];   // stack of the freeing call
+  int alloc_depth;
+  int free_depth;
+  bool in_use;  // true if the slot holds a live allocation
+} guard_slot;
+
+/******************************
+ *******GLOBAL VARIABLES*******
+ ******************************/
+static unsigned long sample_rate = 0;       // mean allocations per sample
+static unsigned long sample_countdown = 0;  // allocations until next sample
+static bool sample_ready = false;
+static uint64_t sample_seed = 0;  // seeded on first use
+
+static char* pool = NULL;  // guard pages and slots
+static size_t pool_bytes = 0;
+static size_t guard_bytes = 0;  // one system page
+static size_t slot_bytes = 0;   // at least PAGE_SIZE, whole system pages
+static guard_slot slots[GUARD_SLOTS];
+
+// free slots, least recently freed first (quarantine order)
+static int free_slots[GUARD_SLOTS];
+static int free_head = 0;
+static int free_count = 0;
+
+static struct sigaction prev_segv;
+static struct sigaction prev_bus;
+
+/**
+ * Seed the sample generator, so that different runs of a program sample
+ * different allocations. Uses the random bytes the kernel hands every Linux
+ * process, or else the process id and the time.
+ *
+ */
+static void seed_sampler(void) {
+#ifdef __linux__
+  const void* entropy = (const void*)getauxval(AT_RANDOM);
+  if (entropy != NULL) {
+    memcpy(&sample_seed, entropy, sizeof(sample_seed));
+  }
+#endif
+  if (!sample_seed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sample_seed = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec ^
+                  ((uint64_t)now.tv_nsec << 20);
+  }
+  if (!sample_seed) {
+    sample_seed = 0x9E3779B97F4A7C15ULL;  // xorshift must not start at 0
+  }
+}
+
+/**
+ * Random countdown to the next sampled allocation, averaging sample_rate.
+ * Uses its own xorshift generator so the program's rand() is not disturbed.
+ *
+ * @return  Number of allocations until the next sample.
+ */
+static unsigned long next_countdown(void) {
+  if (!sample_seed) {
+    seed_sampler();
+  }
+  sample_seed ^= sample_seed << 13;
+  sample_seed ^= sample_seed >> 7;
+  sample_seed ^= sample_seed << 17;
+  return 1 + sample_seed % (2 * sample_rate - 1);
+}
+
+/**
+ * Set how often allocations are sampled.
+ *
+ * @param   rate    Sample about 1 in rate allocations (0 disables sampling).
+ */
+void pm_set_sample_rate(unsigned long rate) {
+  sample_rate = rate;
+  sample_countdown = rate ? next_countdown() : ULONG_MAX;
+  sample_ready = true;
+}
+
+/**
+ * Decide whether the current allocation should come from the guarded pool.
+ * Costs a decrement and a branch for all but the sampled allocations.
+ *
+ * @return  Whether to sample this allocation.
+ */
+bool guard_should_sample(void) {
+  if (sample_countdown > 1) {
+    sample_countdown--;
+    return false;
+  }
+  if (!sample_ready) {
+    const char* env = getenv("PM_GUARD_SAMPLE_RATE");
+    pm_set_sample_rate(env ? strtoul(env, NULL, 10)
+                           : GUARD_DEFAULT_SAMPLE_RATE);
+    return false;
+  }
+  if (!sample_rate) {
+    sample_countdown = ULONG_MAX;
+    return false;
+  }
+  sample_countdown = next_countdown();
+  return true;
+}
+
+/**
+ * Print a stack trace recorded for a slot.
+ *
+ * @param   what    Heading for the trace.
+ * @param   trace   Return addresses.
+ * @param   depth   Number of return addresses.
+ */
+static void print_trace(const char* what, void* const* trace, int depth) {
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%s:\n", what);
+  write(STDERR_FILENO, line, len);
+  backtrace_symbols_fd(trace, depth, STDERR_FILENO);
+}
+
+/**
+ * Print a memory error report for a slot.
+ *
+ * @param   error   Kind of error.
+ * @param   addr    Faulting address (NULL if not known).
+ * @param   idx     Slot the error belongs to.
+ */
+static void report(const char* error, const void* addr, int idx) {
+  char line[160];
+  page* block = &heap[MAX_PAGES + idx];
+  int len = snprintf(line, sizeof(line),
+                     "\n*** pm_guard: %s at %p on page %d <%p> (size: %u) "
+                     "***\n",
+                     error, addr, block->page_id, PAGE_DATA(block),
+                     PAGE_BYTES(block));
+  write(STDERR_FILENO, line, len);
+  print_trace("Allocated by", slots[idx].alloc_trace, slots[idx].alloc_depth);
+  if (!slots[idx].in_use) {
+    print_trace("Freed by", slots[idx].free_trace, slots[idx].free_depth);
+  }
+}
+
+/**
+ * Fault handler: report faults inside the pool, then restore the previous
+ * handler and return so the fault is raised again and handled as before.
+ * Faults outside the pool go straight to the previous handler, and this one
+ * stays installed.
+ *
+ */
+static void guard_fault(int sig, siginfo_t* info, void* context) {
+  char* addr = info->si_addr;
+  struct sigaction* prev = sig == SIGBUS ? &prev_bus : &prev_segv;
+
+  if (addr >= pool && addr < pool + pool_bytes) {
+    size_t stride = guard_bytes + slot_bytes;
+    size_t unit = (addr - pool) / stride;
+    size_t rest = (addr - pool) % stride;
+    if (rest >= guard_bytes) {
+      // only freed or never used slots are inaccessible
+      report(slots[unit].free_depth ? "use after free" : "wild access", addr,
+             (int)unit);
+    } else if (unit == GUARD_SLOTS ||
+               (unit > 0 && rest < guard_bytes / 2)) {
+      // first half of a guard page is past the end of the slot before it
+      report("buffer overflow", addr, (int)unit - 1);
+    } else {
+      report("buffer underflow", addr, (int)unit);
+    }
+    sigaction(sig, prev, NULL);
+    return;
+  }
+
+  if (prev->sa_flags & SA_SIGINFO) {
+    prev->sa_sigaction(sig, info, context);
+  } else if (prev->sa_handler == SIG_DFL || prev->sa_handler == SIG_IGN) {
+    // no handler to call, so let the fault be raised again without us
+    sigaction(sig, prev, NULL);
+  } else {
+    prev->sa_handler(sig);
+  }
+}
+
+/**
+ * Map the pool (all of it inaccessible) and install the fault handler.
+ *
+ * @return  Whether the pool is usable.
+ */
+static bool init_pool(void) {
+  long sys_page = sysconf(_SC_PAGESIZE);
+  guard_bytes = sys_page > 0 ? (size_t)sys_page : PAGE_SIZE;
+  slot_bytes = (PAGE_SIZE + guard_bytes - 1) / guard_bytes * guard_bytes;
+  pool_bytes = GUARD_SLOTS * (guard_bytes + slot_bytes) + guard_bytes;
+
+  void* mem = mmap(NULL, pool_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+  pool = mem;
+  for (int i = 0; i < GUARD_SLOTS; i++) {
+    free_slots[i] = i;
+  }
+  free_count = GUARD_SLOTS;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = guard_fault;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &prev_segv);
+  sigaction(SIGBUS, &action, &prev_bus);  // macOS reports PROT_NONE as SIGBUS
+
+  // the first backtrace() may load the unwinder, which allocates
+  void* warm[1];
+  backtrace(warm, 1);
+  return true;
+}
+
+/**
+ * Start of the slot backing a sampled allocation.
+ *
+ * @param   block   Descriptor of a sampled allocation.
+ * @return  Pointer to the slot.
+ */
+char* guarded_frame(const page* block) {
+  size_t idx = block - heap - MAX_PAGES;
+  return pool + idx * (guard_bytes + slot_bytes) + guard_bytes;
+}
+
+/**
+ * Find the descriptor of a sampled allocation from a pointer into its slot.
+ *
+ * @param   ptr     Pointer to check.
+ * @return  The descriptor, or NULL if ptr is not in a slot.
+ */
+page* guarded_block(const void* ptr) {
+  const char* addr = ptr;
+  if (pool == NULL || addr < pool || addr >= pool + pool_bytes) {
+    return NULL;
+  }
+  size_t stride = guard_bytes + slot_bytes;
+  if ((size_t)(addr - pool) % stride < guard_bytes) {
+    return NULL;
+  }
+  return &heap[MAX_PAGES + (addr - pool) / stride];
+}
+
+/**
+ * Serve an allocation from the guarded pool, placed against the guard page
+ * that follows its slot.
+ *
+ * @param   size        Amount of bytes to allocate.
+ * @param   alignment   Required alignment (a power of two up to PAGE_SIZE).
+ * @param   zero        Whether the memory must be zeroed.
+ * @return  Descriptor of the allocation, or NULL if the pool cannot serve it.
+ */
+page* guarded_malloc(size_t size, size_t alignment, bool zero) {
+  if (pool == NULL && !init_pool()) {
+    pm_set_sample_rate(0);
+    return NULL;
+  }
+  if (!free_count || size > slot_bytes) {
+    return NULL;
+  }
+  int idx = free_slots[free_head];
+  free_head = (free_head + 1) % GUARD_SLOTS;
+  free_count--;
+
+  page* block = &heap[MAX_PAGES + idx];
+  char* frame = guarded_frame(block);
+  mprotect(frame, slot_bytes, PROT_READ | PROT_WRITE);
+  if (zero) {
+    memset(frame, 0, slot_bytes);
+  }
+  if (alignment < GUARD_MIN_ALIGNMENT) {
+    alignment = GUARD_MIN_ALIGNMENT;
+  }
+  block->span = 1;
+  PAGE_BYTES(block) = size;
+  PAGE_OFFSET(block) = (slot_bytes - size) & ~(alignment - 1);
+  slots[idx].in_use = true;
+  slots[idx].alloc_depth = backtrace(slots[idx].alloc_trace, GUARD_TRACE_DEPTH);
+  return block;
+}
+
+/**
+ * Free a sampled allocation. The slot becomes inaccessible and goes to the
+ * back of the free list, so later accesses through stale pointers fault.
+ *
+ * @param   block   Descriptor of a sampled allocation.
+ */
+void guarded_free(page* block) {
+  int idx = block - heap - MAX_PAGES;
+
+  if (!slots[idx].in_use) {
+    report("double free", PAGE_DATA(block), idx);
+    abort();
+  }
+  slots[idx].in_use = false;
+  slots[idx].free_depth = backtrace(slots[idx].free_trace, GUARD_TRACE_DEPTH);
+  mprotect(guarded_frame(block), slot_bytes, PROT_NONE);
+  block->span = 0;
+
+  free_slots[(free_head + free_count) % GUARD_SLOTS] = idx;
+  free_count++;
+}
@@ -0,0 +1,339 @@
+/**
+ * @file pm_preload.c
+ * @author Edgar Alan David and Stephano Barrios-Pompei
+ * @brief Interposes the C allocator onto the programmed managed heap so that
+ * unmodified programs can be run on it:
+ *
+ *   make libpm_preload.so
+ *   LD_PRELOAD=./libpm_preload.so ./some_program
+ *
+ * Requests the heap cannot serve (too large, over-aligned, or heap full) fall
+ * back to the next allocator in the link chain (normally libc). Pointers are
+ * routed back to their owner by address, so both kinds can be mixed freely.
+ * @version 0.1
+ * @date 2022-11-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "practicum1.h"
+
+/******************************
+ ******MACROS AND STRUCTS******
+ ******************************/
+// only the allocator entry points are visible outside the library
+#define EXPORT __attribute__((visibility("default")))
+// serves allocations made while the fallback allocator is being looked up
+#define BOOTSTRAP_SIZE 64 * 1024
+#define BOOTSTRAP_HEADER 16  // keeps bootstrap blocks 16 byte aligned
+
+/******************************
+ *******GLOBAL VARIABLES*******
+ ******************************/
+// the heap is not thread safe, so every pm_* call is made under this lock
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool heap_ready = false;
+// set while this thread is inside the heap; allocations made from there (e.g.
+// by backtrace() loading the unwinder) go to the fallback allocator instead
+static _Thread_local bool in_heap __attribute__((tls_model("initial-exec")));
+
+// next allocator in the link chain, looked up with dlsym
+static void* (*real_malloc)(size_t);
+static void (*real_free)(void*);
+static void* (*real_calloc)(size_t, size_t);
+static void* (*real_realloc)(void*, size_t);
+static int (*real_posix_memalign)(void**, size_t, size_t);
+static size_t (*real_malloc_usable_size)(void*);
+static bool resolving = false;
+
+_Alignas(BOOTSTRAP_HEADER) static char bootstrap[BOOTSTRAP_SIZE];
+static size_t bootstrap_used = 0;
+
+/**
+ * Look up the fallback allocator. dlsym may itself allocate; those requests
+ * are served by the managed heap or, failing that, the bootstrap arena.
+ *
+ */
+static void resolve_real(void) {
+  if (real_malloc != NULL || resolving) {
+    return;
+  }
+  resolving = true;
+  // POSIX assignment form, since ISO C has no object to function pointer cast
+  *(void**)&real_free = dlsym(RTLD_NEXT, "free");
+  *(void**)&real_calloc = dlsym(RTLD_NEXT, "calloc");
+  *(void**)&real_realloc = dlsym(RTLD_NEXT, "realloc");
+  *(void**)&real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  *(void**)&real_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+  *(void**)&real_malloc = dlsym(RTLD_NEXT, "malloc");
+  resolving = false;
+}
+
+// hold heap_lock across fork() so the child never inherits it locked by a
+// thread that does not exist in the child
+static void fork_prepare(void) {
+  pthread_mutex_lock(&heap_lock);
+}
+
+static void fork_parent(void) {
+  pthread_mutex_unlock(&heap_lock);
+}
+
+static void fork_child(void) {
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// resolve the fallback allocator at load time, before any threads exist
+__attribute__((constructor)) static void pm_preload_init(void) {
+  resolve_real();
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/**
+ * Bump allocate from the bootstrap arena. Bootstrap memory is never reused,
+ * so it is always zeroed and freeing it is a no-op.
+ *
+ * @param   size    Amount of bytes to allocate.
+ * @return  Pointer to the memory, or NULL if the arena is exhausted.
+ */
+static void* bootstrap_malloc(size_t size) {
+  size_t align = BOOTSTRAP_HEADER - 1;
+  size_t need = BOOTSTRAP_HEADER + ((size + align) & ~align);
+  size_t offset = __atomic_fetch_add(&bootstrap_used, need, __ATOMIC_RELAXED);
+  if (need > BOOTSTRAP_SIZE || offset > BOOTSTRAP_SIZE - need) {
+    return NULL;
+  }
+  *(size_t*)&bootstrap[offset] = size;
+  return &bootstrap[offset + BOOTSTRAP_HEADER];
+}
+
+static bool is_bootstrap(void* ptr) {
+  return (char*)ptr >= bootstrap && (char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrap_size(void* ptr) {
+  return *(size_t*)((char*)ptr - BOOTSTRAP_HEADER);
+}
+
+/**
+ * Find the page describing a pointer into the managed heap or its guarded
+ * pool of sampled allocations.
+ *
+ * @param   ptr     Pointer returned by one of the allocator entry points.
+ * @return  The first page of the allocation, or NULL if ptr is not ours.
+ */
+static page* heap_block(void* ptr) {
+  uintptr_t addr = (uintptr_t)ptr;
+  uintptr_t base = (uintptr_t)heap_frames;
+
+  if (addr < base || addr >= base + sizeof(heap_frames)) {
+    return guarded_block(ptr);
+  }
+  return &heap[(addr - base) / PAGE_SIZE];
+}
+
+static void heap_lock_acquire(void) {
+  pthread_mutex_lock(&heap_lock);
+  in_heap = true;
+  if (!heap_ready) {
+    initialize_pages();
+    heap_ready = true;
+  }
+}
+
+static void heap_lock_release(void) {
+  in_heap = false;
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/**
+ * Allocate from the managed heap.
+ *
+ * @param   size    Amount of bytes to allocate.
+ * @param   zero    Whether the memory must be zeroed.
+ * @return  Pointer to the memory, or NULL if the heap cannot serve it.
+ */
+static void* heap_malloc(size_t size, bool zero) {
+  if (in_heap) {
+    return NULL;
+  }
+  heap_lock_acquire();
+  page* block = zero ? pm_calloc(1, size) : pm_malloc(size);
+  heap_lock_release();
+
+  return block ? PAGE_DATA(block) : NULL;
+}
+
+/**
+ * Allocate aligned memory from the managed heap.
+ *
+ * @param   alignment   Required alignment (a power of two up to PAGE_SIZE).
+ * @param   size        Amount of bytes to allocate.
+ * @return  Pointer to the memory, or NULL if the heap cannot serve it.
+ */
+static void* heap_memalign(size_t alignment, size_t size) {
+  if (in_heap) {
+    return NULL;
+  }
+  heap_lock_acquire();
+  page* block = pm_memalign(alignment, size);
+  heap_lock_release();
+
+  return block ? PAGE_DATA(block) : NULL;
+}
+
+static void* fallback_malloc(size_t size) {
+  resolve_real();
+  return real_malloc ? real_malloc(size) : bootstrap_malloc(size);
+}
+
+/******************************
+ ******ALLOCATOR ENTRY POINTS**
+ ******************************/
+EXPORT void* malloc(size_t size) {
+  // malloc(0) must still return a unique pointer
+  void* ptr = heap_malloc(size ? size : 1, false);
+
+  return ptr ? ptr : fallback_malloc(size);
+}
+
+EXPORT void free(void* ptr) {
+  if (ptr == NULL || is_bootstrap(ptr)) {
+    return;
+  }
+  page* block = heap_block(ptr);
+  if (block == NULL) {
+    real_free(ptr);
+    return;
+  }
+  heap_lock_acquire();
+  pm_free(block);
+  heap_lock_release();
+}
+
+EXPORT void* calloc(size_t nmemb, size_t size) {
+  // check for multiplication overflow
+  if (nmemb && size > SIZE_MAX / nmemb) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size_t bytes = nmemb * size;
+  void* ptr = heap_malloc(bytes ? bytes : 1, true);
+  if (ptr != NULL) {
+    return ptr;
+  }
+
+  resolve_real();
+  return real_calloc ? real_calloc(nmemb, size) : bootstrap_malloc(bytes);
+}
+
+EXPORT void* realloc(void* ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (!size) {
+    free(ptr);
+    return NULL;
+  }
+
+  size_t old_size;
+  page* block = heap_block(ptr);
+  if (block != NULL) {
+    // grows or shrinks in place when the neighbouring pages allow it
+    heap_lock_acquire();
+    page* moved = pm_realloc(block, size);
+    old_size = PAGE_BYTES(block);
+    heap_lock_release();
+    if (moved != NULL) {
+      return PAGE_DATA(moved);
+    }
+  } else if (is_bootstrap(ptr)) {
+    old_size = bootstrap_size(ptr);
+  } else {
+    return real_realloc(ptr, size);
+  }
+
+  // the heap cannot hold the new size, move the block to the fallback
+  void* moved = block ? fallback_malloc(size) : malloc(size);
+  if (moved == NULL) {
+    return NULL;
+  }
+  memcpy(moved, ptr, old_size < size ? old_size : size);
+  free(ptr);
+  return moved;
+}
+
+EXPORT void* reallocarray(void* ptr, size_t nmemb, size_t size) {
+  // check for multiplication overflow
+  if (nmemb && size > SIZE_MAX / nmemb) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, nmemb * size);
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  // alignment must be a power of two multiple of sizeof(void*)
+  if (alignment % sizeof(void*) || (alignment & (alignment - 1))) {
+    return EINVAL;
+  }
+  if (alignment <= PAGE_SIZE) {
+    void* ptr = heap_memalign(alignment, size ? size : 1);
+    if (ptr != NULL) {
+      *memptr = ptr;
+      return 0;
+    }
+  }
+
+  resolve_real();
+  return real_posix_memalign ? real_posix_memalign(memptr, alignment, size)
+                             : ENOMEM;
+}
+
+EXPORT void* memalign(size_t alignment, size_t size) {
+  void* ptr;
+  if (alignment < sizeof(void*)) {
+    alignment = sizeof(void*);
+  }
+  int err = posix_memalign(&ptr, alignment, size);
+  if (err) {
+    errno = err;
+    return NULL;
+  }
+  return ptr;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+EXPORT size_t malloc_usable_size(void* ptr) {
+  if (ptr == NULL) {
+    return 0;
+  }
+  if (is_bootstrap(ptr)) {
+    return bootstrap_size(ptr);
+  }
+  page* block = heap_block(ptr);
+  if (block == NULL) {
+    return real_malloc_usable_size(ptr);
+  }
+
+  // sampled allocations report their exact size so overflows still fault
+  heap_lock_acquire();
+  size_t usable =
+      IS_GUARDED(block)
+          ? PAGE_BYTES(block)
+          : (size_t)block->span * PAGE_SIZE - PAGE_OFFSET(block);
+  heap_lock_release();
+  return usable;
+}
@@ -13,48 +13,53 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifndef PM_PRELOAD
+#include <sys/wait.h>  // guard_demo
+#endif
+// x86 builds carry an AVX2 variant of each sweep kernel, picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PM_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "practicum1.h"
 
 /******************************
  ******MACROS AND STRUCTS******
  ******************************/
-// define start of memory and adjustment for header overhead
-#define BLOCK_DATA(ptr) ((void*)((unsigned long)ptr + sizeof(page)))
-#define BLOCK_HEADER(ptr) ((void*)((unsigned long)ptr - sizeof(page)))
-// our heap is the same size as a Playstation 2 Memory Card!
-// with a 4KB page size, we can have 2048 pages
-#define HEAP_CAPACITY 8 * 1024 * 1024  // 8 MB heap
-#define PAGE_SIZE 4096                 // 4 KB page size
-#define MAX_PAGES 2048  // 2048 pages (4 KB each) fit in our heap (8 MB)
 #define UPPER_LIMIT_FOR_TEST 4000
 #define LOWER_LIMIT_FOR_TEST 1028
 
-typedef struct page {
-  int page_id;   // unique page id
-  size_t size;   // how many bytes allocated in the page
-  bool is_free;  // true if page is free
-  bool on_disk;  // true if page is on disk
-} page;
-
 // keep track of pages in primary memory (RAM) and disk memory
 typedef struct pte {
   int page_id;
   int frame;
 } pte;
 
-page* pm_malloc(size_t size);
-
 /******************************
  *******GLOBAL VARIABLES*******
  ******************************/
 // Pre-allocate 8MB "heap" memory from the static store with room for metadata
-page heap[MAX_PAGES];
+page heap[HEAP_DESCRIPTORS];
+uint32_t heap_sizes[HEAP_DESCRIPTORS];    // bytes allocated in each page
+uint16_t heap_offsets[HEAP_DESCRIPTORS];  // cache colour offset in first page
+uint64_t heap_free_map[MAP_WORDS];        // bit set if page is free
+uint64_t heap_zero_map[MAP_WORDS];        // bit set if page's frame is all zero
+uint64_t heap_disk_map[MAP_WORDS];        // bit set if page is on disk
+// memory backing each page in heap (heap[i] describes heap_frames[i])
+// (page aligned, so any alignment up to PAGE_SIZE holds for a page's frame)
+_Alignas(PAGE_SIZE) char heap_frames[MAX_PAGES][PAGE_SIZE];
 size_t heap_pages_in_use = 0;  // keep track of how many PAGES are allocated in
                                // heap (1 page = 4096 KB allocated)
 pte* page_table;  // keep track of pages in primary and secondary memory
 page disk_list[MAX_PAGES];  // keep track of pages on disk (secondary memory)
+bool use_avx2 = false;          // run the AVX2 sweep kernels (set at init)
+unsigned int next_colour = 0;  // cache colour of the next allocation
 int page_id = 1;  // unique page id for each page in heap (start as 1 to avoid
                   // confusion with NULL or 0. 0 is NOT a valid page_id)
 
@@ -327,46 +332,499 @@ void lru() {
   }
 }
 
+/******************************
+ *********SWEEP KERNELS********
+ ******************************/
+#ifdef PM_AVX2
+/**
+ * Skip groups of four bitmap words that all equal pattern (AVX2).
+ *
+ * @param   map     Page bitmap.
+ * @param   w       Index of the first word to check.
+ * @param   pattern Word value to skip over.
+ * @return  Index of the first group that differs, or of the leftover words.
+ */
+PM_AVX2 static size_t skip_words_avx2(const uint64_t* map, size_t w,
+                                      uint64_t pattern) {
+  __m256i pat = _mm256_set1_epi64x((long long)pattern);
+  for (; w + 4 <= MAP_WORDS; w += 4) {
+    __m256i words = _mm256_loadu_si256((const __m256i*)&map[w]);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(words, pat)) != -1) {
+      break;
+    }
+  }
+  return w;
+}
+#endif
+
+#ifdef __SSE2__
+/**
+ * Skip pairs of bitmap words that both equal pattern (SSE2).
+ *
+ * @param   map     Page bitmap.
+ * @param   w       Index of the first word to check.
+ * @param   pattern Word value to skip over.
+ * @return  Index of the first pair that differs, or of the leftover word.
+ */
+static size_t skip_words_sse2(const uint64_t* map, size_t w,
+                              uint64_t pattern) {
+  // SSE2 has no 64 bit compare, but two equal 32 bit halves mean equal words
+  __m128i pat = _mm_set1_epi64x((long long)pattern);
+  for (; w + 2 <= MAP_WORDS; w += 2) {
+    __m128i words = _mm_loadu_si128((const __m128i*)&map[w]);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(words, pat)) != 0xFFFF) {
+      break;
+    }
+  }
+  return w;
+}
+#endif
+
+/**
+ * Find the first bitmap word at or after from that differs from pattern.
+ * Compares four (AVX2) or two (SSE2) words at a time where available.
+ *
+ * @param   map     Page bitmap.
+ * @param   from    Index of the first word to check.
+ * @param   pattern Word value to skip over.
+ * @return  Index of the word, or MAP_WORDS if every word matches.
+ */
+static size_t next_word_not(const uint64_t* map, size_t from,
+                            uint64_t pattern) {
+  size_t w = from;
+
+#ifdef PM_AVX2
+  if (use_avx2) {
+    w = skip_words_avx2(map, w, pattern);
+  }
+#endif
+#ifdef __SSE2__
+  if (!use_avx2) {
+    w = skip_words_sse2(map, w, pattern);
+  }
+#endif
+  while (w < MAP_WORDS && map[w] == pattern) {
+    w++;
+  }
+  return w;
+}
+
+/**
+ * Find the first page at or after from whose bit in map equals value.
+ *
+ * @param   map     Page bitmap.
+ * @param   from    Index of the first page to check.
+ * @param   value   Bit value to look for.
+ * @return  Index of the page, or MAX_PAGES if there is none.
+ */
+static int next_page(const uint64_t* map, int from, bool value) {
+  size_t w = from / 64;
+  if (from >= MAX_PAGES) {
+    return MAX_PAGES;
+  }
+
+  uint64_t bits = (value ? map[w] : ~map[w]) & (~(uint64_t)0 << (from % 64));
+  while (!bits) {
+    // words without the value are all zero (or all one when looking for 0)
+    w = next_word_not(map, w + 1, value ? 0 : ~(uint64_t)0);
+    if (w >= MAP_WORDS) {
+      return MAX_PAGES;
+    }
+    bits = value ? map[w] : ~map[w];
+  }
+  return (int)(w * 64) + __builtin_ctzll(bits);
+}
+
+/**
+ * Set or clear the bits of count pages in a bitmap, a word at a time.
+ *
+ * @param   map     Page bitmap.
+ * @param   start   Index of the first page.
+ * @param   count   Number of pages.
+ * @param   value   Bit value to store.
+ */
+static void fill_pages(uint64_t* map, size_t start, size_t count, bool value) {
+  size_t end = start + count;
+
+  while (start < end) {
+    size_t bit = start % 64;
+    size_t n = end - start < 64 - bit ? end - start : 64 - bit;
+    uint64_t mask = (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << bit;
+    map[start / 64] = value ? map[start / 64] | mask : map[start / 64] & ~mask;
+    start += n;
+  }
+}
+
+#ifdef PM_AVX2
+// sum heap_sizes eight pages at a time (AVX2)
+PM_AVX2 static uint32_t total_page_bytes_avx2(void) {
+  __m256i acc = _mm256_setzero_si256();
+  for (size_t i = 0; i < MAX_PAGES; i += 8) {
+    acc = _mm256_add_epi32(
+        acc, _mm256_loadu_si256((const __m256i*)&heap_sizes[i]));
+  }
+  uint32_t lanes[8];
+  uint32_t total = 0;
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  for (int l = 0; l < 8; l++) {
+    total += lanes[l];
+  }
+  return total;
+}
+#endif
+
+#ifdef __SSE2__
+// sum heap_sizes four pages at a time (SSE2)
+static uint32_t total_page_bytes_sse2(void) {
+  __m128i acc = _mm_setzero_si128();
+  for (size_t i = 0; i < MAX_PAGES; i += 4) {
+    acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)&heap_sizes[i]));
+  }
+  uint32_t lanes[4];
+  uint32_t total = 0;
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  for (int l = 0; l < 4; l++) {
+    total += lanes[l];
+  }
+  return total;
+}
+#endif
+
+/**
+ * Sum the bytes allocated across every page in heap. MAX_PAGES is a
+ * multiple of 64 (see MAP_WORDS), so the vector variants cover every page.
+ *
+ * @return  Total of heap_sizes (fits 32 bits, as it cannot exceed the heap).
+ */
+static uint32_t total_page_bytes(void) {
+#ifdef PM_AVX2
+  if (use_avx2) {
+    return total_page_bytes_avx2();
+  }
+#endif
+#ifdef __SSE2__
+  return total_page_bytes_sse2();
+#else
+  uint32_t total = 0;
+  for (size_t i = 0; i < MAX_PAGES; i++) {
+    total += heap_sizes[i];
+  }
+  return total;
+#endif
+}
+
+/******************************
+ ***********ALLOCATOR**********
+ ******************************/
+/**
+ * Find the first run of contiguous free pages in heap, a bitmap word at a
+ * time. Runs inside a word are found by and-ing the word with itself shifted,
+ * runs across words by carrying the free pages at the top of each word.
+ *
+ * @param   npages  Number of pages needed.
+ * @return  Index of the first page in the run, or -1 if none is long enough.
+ */
+static int find_free_run(size_t npages) {
+  size_t carry = 0;  // free pages ending at the top of the previous word
+
+  for (size_t w = 0; w < MAP_WORDS; w++) {
+    if (!carry) {
+      // skip whole words of used pages
+      w = next_word_not(heap_free_map, w, 0);
+      if (w >= MAP_WORDS) {
+        break;
+      }
+    }
+    uint64_t word = heap_free_map[w];
+    size_t low = word == ~(uint64_t)0 ? 64 : (size_t)__builtin_ctzll(~word);
+    if (carry + low >= npages) {
+      return (int)(w * 64 - carry);
+    }
+
+    if (npages <= 64) {
+      // bit i of runs is set if pages i to i + npages - 1 are all free
+      uint64_t runs = word;
+      for (size_t len = 1; len < npages && runs;) {
+        size_t shift = len < npages - len ? len : npages - len;
+        runs &= runs >> shift;
+        len += shift;
+      }
+      if (runs) {
+        return (int)(w * 64) + __builtin_ctzll(runs);
+      }
+    }
+    carry = word == ~(uint64_t)0 ? carry + 64
+            : word ? (size_t)__builtin_clzll(~word)
+                   : 0;
+  }
+  return -1;
+}
+
+/**
+ * Mark pages as continuation pages of an allocation.
+ *
+ * @param   start   Index of the first page to claim.
+ * @param   count   Number of pages to claim.
+ */
+static void claim_pages(size_t start, size_t count) {
+  fill_pages(heap_free_map, start, count, false);
+  fill_pages(heap_zero_map, start, count, false);
+  fill_pages(heap_disk_map, start, count, false);
+  memset(&heap_sizes[start], 0, count * sizeof(heap_sizes[0]));
+  memset(&heap_offsets[start], 0, count * sizeof(heap_offsets[0]));
+  for (size_t i = start; i < start + count; i++) {
+    heap[i].span = 0;
+  }
+  heap_pages_in_use += count;
+}
+
+/**
+ * Return pages to the heap. Their frames are no longer known to be zero.
+ *
+ * @param   start   Index of the first page to release.
+ * @param   count   Number of pages to release.
+ */
+static void release_pages(size_t start, size_t count) {
+  fill_pages(heap_free_map, start, count, true);
+  fill_pages(heap_zero_map, start, count, false);
+  fill_pages(heap_disk_map, start, count, false);
+  memset(&heap_sizes[start], 0, count * sizeof(heap_sizes[0]));
+  memset(&heap_offsets[start], 0, count * sizeof(heap_offsets[0]));
+  for (size_t i = start; i < start + count; i++) {
+    heap[i].span = 0;
+  }
+  heap_pages_in_use -= count;
+}
+
+/**
+ * Pick the offset of the next allocation within its first page. Every
+ * allocation starts on a page boundary, so without an offset they would all
+ * map to the same L1 cache sets. Offsets cycle through the cache lines of a
+ * page (cache colouring) using only slack the allocation leaves unused.
+ *
+ * @param   slack       Unused bytes in the allocation's pages.
+ * @param   alignment   Required alignment (a power of two up to PAGE_SIZE).
+ * @return  Offset in bytes, a multiple of both alignment and CACHE_LINE_SIZE.
+ */
+static uint16_t colour_offset(size_t slack, size_t alignment) {
+  size_t step = alignment > CACHE_LINE_SIZE ? alignment : CACHE_LINE_SIZE;
+  size_t offset = (next_colour++ % (PAGE_SIZE / step)) * step;
+
+  if (offset > slack) {
+    offset = slack / step * step;
+  }
+  return (uint16_t)offset;
+}
+
+/**
+ * Allocate a run of pages, optionally zeroing their frames. Pages whose
+ * frames are already known to be zero are not cleared again.
+ *
+ * @param   size        Amount of bytes to allocate.
+ * @param   alignment   Required alignment (a power of two up to PAGE_SIZE).
+ * @param   zero        Whether the memory must be zeroed.
+ * @return  Pointer to the first page of the allocation.
+ */
+static page* alloc_pages(size_t size, size_t alignment, bool zero) {
+  // check null size, too small, or too big (max allocable is the whole heap)
+  if (!size || size < 1 || size > HEAP_CAPACITY) {
+    return NULL;
+  }
+  // serve roughly 1 in PM_GUARD_SAMPLE_RATE allocations between guard pages
+  if (guard_should_sample()) {
+    page* sampled = guarded_malloc(size, alignment, zero);
+    if (sampled != NULL) {
+      sampled->page_id = page_id;
+      page_id++;
+      return sampled;
+    }
+  }
+  size_t npages = PAGES_FOR(size);
+  // check if we have enough space (in pages) in heap
+  if (heap_pages_in_use + npages > MAX_PAGES) {
+    // printf("heap full\n");
+    return NULL;
+  }
+
+  // first fit algorithm
+  int start = find_free_run(npages);
+  if (start < 0) {
+#ifndef PM_PRELOAD
+    printf("No free pages in heap\n");
+#endif
+    return NULL;
+  }
+  if (zero) {
+    for (size_t i = start; i < start + npages; i++) {
+      if (!MAP_TEST(heap_zero_map, i)) {
+        memset(heap_frames[i], 0, PAGE_SIZE);
+      }
+    }
+  }
+  claim_pages(start, npages);
+
+  page* curr = &heap[start];
+  PAGE_BYTES(curr) = size;
+  PAGE_OFFSET(curr) = colour_offset(npages * PAGE_SIZE - size, alignment);
+  curr->page_id = page_id;
+  curr->span = (int)npages;
+  page_id++;
+  // printf("Allocated page %d at address %p\n", curr->page_id, (void*)curr);
+  return curr;
+}
+
 /**
  * Allocate specified amount memory.
- * ASSUMPTION: Nobody will request more than 4080 KB (page size - metadata)
+ * Requests larger than a page (4096 bytes) take a run of contiguous pages.
  *
  * @param   size    Amount of bytes to allocate.
  * @return  Pointer to the requested amount of memory.
  **/
 page* pm_malloc(size_t size) {
   // printf("pm_malloc called with size: %zu\n", size);
-  // check null size, too small, or too big (max allocable is 4096 - metadata)
-  if (!size || size < 1 || size > PAGE_SIZE - sizeof(page)) {
-    // printf(
-    //     "Bad size! Either null, less than 1, or greater than max allocable
-    //     "
-    //     "(4080 bytes)\n");
+  return alloc_pages(size, 1, false);
+}
+
+/**
+ * Allocate zeroed memory for an array of nmemb elements of size bytes each.
+ * Fresh pages are already zero, so only reused pages are cleared.
+ *
+ * @param   nmemb   Number of elements.
+ * @param   size    Size of each element in bytes.
+ * @return  Pointer to the requested amount of zeroed memory.
+ */
+page* pm_calloc(size_t nmemb, size_t size) {
+  // check for multiplication overflow
+  if (nmemb && size > SIZE_MAX / nmemb) {
     return NULL;
   }
-  // check if we have enough space (in pages) in heap
-  if (heap_pages_in_use + 1 > MAX_PAGES) {
-    // printf("heap full\n");
+  return alloc_pages(nmemb * size, 1, true);
+}
+
+/**
+ * Allocate memory aligned to a power of two up to PAGE_SIZE. With
+ * PM_CACHE_ISOLATED the object is also padded to whole cache lines, so it
+ * shares no line with any other object (e.g. per-thread counters).
+ *
+ * @param   size        Amount of bytes to allocate.
+ * @param   alignment   Required alignment in bytes.
+ * @param   flags       0 or PM_CACHE_ISOLATED.
+ * @return  Pointer to the requested amount of memory, or NULL if alignment
+ * is not a power of two up to PAGE_SIZE.
+ */
+page* pm_malloc_aligned(size_t size, size_t alignment, int flags) {
+  if (!alignment || (alignment & (alignment - 1)) || alignment > PAGE_SIZE) {
     return NULL;
   }
-  heap_pages_in_use++;
+  if (flags & PM_CACHE_ISOLATED) {
+    if (alignment < CACHE_LINE_SIZE) {
+      alignment = CACHE_LINE_SIZE;
+    }
+    size = (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+  }
+  return alloc_pages(size, alignment, false);
+}
 
-  // first fit algorithm
-  for (int i = 0; i < MAX_PAGES; i++) {
-    page* curr = &heap[i];
-    if (curr->is_free) {  // <---- SEGFAULT (was) HERE ;)
-      curr->is_free = false;
-      curr->size = size + sizeof(page);
-      curr->on_disk = false;
-      curr->page_id = page_id;
-      page_id++;
-      // printf("Allocated page %d at address %p\n", curr->page_id,
-      // (void*)curr);
-      return curr;
+/**
+ * Allocate memory aligned to a power of two up to PAGE_SIZE.
+ *
+ * @param   alignment   Required alignment in bytes.
+ * @param   size        Amount of bytes to allocate.
+ * @return  Pointer to the requested amount of memory.
+ */
+page* pm_memalign(size_t alignment, size_t size) {
+  return pm_malloc_aligned(size, alignment, 0);
+}
+
+/**
+ * Move a block's data to the start of its first page, so it no longer pays
+ * for its cache colour (offset 0 meets any alignment).
+ *
+ * @param   block   Block being resized in place.
+ * @param   size    New amount of bytes.
+ */
+static void drop_colour(page* block, size_t size) {
+  size_t old_size = PAGE_BYTES(block);
+  memmove(PAGE_FRAME(block), PAGE_DATA(block),
+          old_size < size ? old_size : size);
+  PAGE_OFFSET(block) = 0;
+}
+
+/**
+ * Resize previously allocated memory block. Shrinking releases trailing
+ * pages and growing claims the free pages that follow the block, so the
+ * contents are only copied when the neighbouring pages are in use.
+ *
+ * @param   block   Pointer to block to resize (NULL behaves like pm_malloc).
+ * @param   size    New amount of bytes (0 behaves like pm_free).
+ * @return  Pointer to the resized block, or NULL if it could not be resized
+ * (the original block is left untouched).
+ */
+page* pm_realloc(page* block, size_t size) {
+  if (block == NULL) {
+    return pm_malloc(size);
+  }
+  if (!size) {
+    pm_free(block);
+    return NULL;
+  }
+  // sampled allocations always move, keeping them against their guard page
+  if (IS_GUARDED(block)) {
+    page* moved = pm_malloc(size);
+    if (moved == NULL) {
+      return NULL;
     }
+    size_t old_size = PAGE_BYTES(block);
+    memcpy(PAGE_DATA(moved), PAGE_DATA(block),
+           old_size < size ? old_size : size);
+    pm_free(block);
+    return moved;
   }
-  printf("No free pages in heap\n");
-  return NULL;
+  // a cache colour that would cost a page of its own is dropped
+  size_t offset = PAGE_OFFSET(block);
+  bool uncolour = offset && PAGES_FOR(size + offset) > PAGES_FOR(size);
+  if (uncolour) {
+    offset = 0;
+  }
+  if (size > HEAP_CAPACITY - offset) {
+    return NULL;
+  }
+  size_t idx = block - heap;
+  size_t span = block->span;
+  size_t npages = PAGES_FOR(size + offset);
+
+  // shrink (or stay) in place
+  if (npages <= span) {
+    if (uncolour) {
+      drop_colour(block, size);
+    }
+    release_pages(idx + npages, span - npages);
+    block->span = (int)npages;
+    PAGE_BYTES(block) = size;
+    return block;
+  }
+
+  // grow in place if the following pages are free
+  size_t end = idx + npages;
+  if (end <= MAX_PAGES &&
+      (size_t)next_page(heap_free_map, idx + span, false) >= end) {
+    claim_pages(idx + span, npages - span);
+    if (uncolour) {
+      drop_colour(block, size);
+    }
+    block->span = (int)npages;
+    PAGE_BYTES(block) = size;
+    return block;
+  }
+
+  // move to a new run of pages
+  page* moved = pm_malloc(size);
+  if (moved == NULL) {
+    return NULL;
+  }
+  memcpy(PAGE_DATA(moved), PAGE_DATA(block), PAGE_BYTES(block));
+  pm_free(block);
+  return moved;
 }
 
 /**
@@ -377,34 +835,49 @@ page* pm_malloc(size_t size) {
  * @return  Whether or not the release completed successfully.
  */
 void pm_free(page* block) {
-  if (block == NULL) {
+  if (block != NULL && IS_GUARDED(block)) {
+    guarded_free(block);
     return;
   }
-  block->is_free = true;
-  block->size = 0;
-  block->on_disk = false;
-  heap_pages_in_use--;
+  if (block == NULL || PAGE_IS_FREE(block) || !block->span) {
+    return;
+  }
+  release_pages(block - heap, block->span);
 
   return;
 }
 
 /**
- * Initialize the heap.
+ * Segment the heap into free pages without printing anything, so it can run
+ * before stdio is usable (e.g. from the malloc interposition library).
  *
  */
-void initialize_heap() {
-  // page_table = initialize_page_table();
-
+void initialize_pages(void) {
   // segment heap into pages
   for (int i = 0; i < MAX_PAGES; i++) {
     page* curr = &heap[i];
-    curr->is_free = true;
-    curr->size = 0;
-    // curr->address = NULL;
-    curr->on_disk = false;
+    curr->span = 0;
     curr->page_id = i;
-    // curr->data = NULL;
   }
+#ifdef PM_AVX2
+  __builtin_cpu_init();
+  use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+  memset(heap_sizes, 0, sizeof(heap_sizes));
+  memset(heap_offsets, 0, sizeof(heap_offsets));
+  memset(heap_free_map, 0xFF, sizeof(heap_free_map));
+  memset(heap_zero_map, 0xFF, sizeof(heap_zero_map));  // static store is zero
+  memset(heap_disk_map, 0, sizeof(heap_disk_map));
+}
+
+/**
+ * Initialize the heap.
+ *
+ */
+void initialize_heap() {
+  // page_table = initialize_page_table();
+
+  initialize_pages();
 
   // heap will be an array of pages
   // track pages in primary memory by accessing heap
@@ -430,15 +903,8 @@ void initialize_heap() {
  * heap.
  */
 double internal_fragmentation() {
-  int i = 0;
-  double waste = 0;
-  // page* curr = heap;
-  //  size_t heap_pages_in_use = 0;
-
-  while (i < MAX_PAGES) {
-    waste += (PAGE_SIZE - heap[i].size);
-    i++;
-  }
+  // every page wastes PAGE_SIZE less the bytes allocated in it
+  double waste = (double)HEAP_CAPACITY - total_page_bytes();
 
   return waste / (HEAP_CAPACITY)*100;
 }
@@ -465,19 +931,19 @@ void move_to_disk() {
  * Print out contents of heap
  */
 void print_allocated_statistics() {
-  int i = 0;
   int bytes = 0;
-  page* curr = &heap[i];
   printf("Allocation Statistics:\n");
   printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
-  while (curr && i < MAX_PAGES) {
-    if (!curr->is_free) {
-      printf("Page %d) <%p> \t(size: %ld)\n", curr->page_id, (void*)curr,
-             curr->size);
-      bytes += curr->size;
+  // visit only allocated pages
+  for (int i = next_page(heap_free_map, 0, false); i < MAX_PAGES;
+       i = next_page(heap_free_map, i + 1, false)) {
+    page* curr = &heap[i];
+    // continuation pages are counted with the first page of their allocation
+    if (curr->span) {
+      printf("Page %d) <%p> \t(size: %u)\n", curr->page_id, (void*)curr,
+             PAGE_BYTES(curr));
+      bytes += PAGE_BYTES(curr);
     }
-    ++curr;
-    ++i;
   }
   if (bytes == 0) {
     printf("No pages allocated.\n\n");
@@ -502,7 +968,7 @@ void alloc_and_print_max_statistics() {
     curr =
         pm_malloc(rand() % (UPPER_LIMIT_FOR_TEST - LOWER_LIMIT_FOR_TEST + 1) +
                   LOWER_LIMIT_FOR_TEST);
-    bytes += curr->size;
+    bytes += PAGE_BYTES(curr);
     ++curr;
     ++i;
     if (i % 200 == 0) {
@@ -519,7 +985,38 @@ void alloc_and_print_max_statistics() {
   printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
 }
 
+#ifndef PM_PRELOAD
+/**
+ * Demonstrate the guard-page sampler in a child process, which is expected
+ * to be stopped by the fault it reports.
+ *
+ * @param   use_after_free  Access a freed block instead of overflowing one.
+ */
+void guard_demo(bool use_after_free) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    pm_set_sample_rate(1);  // sample every allocation
+    page* block = pm_malloc(128);
+    char* data = PAGE_DATA(block);
+    if (use_after_free) {
+      pm_free(block);
+      data[0] = 1;
+    } else {
+      data[128] = 1;  // one byte past the end
+    }
+    _exit(0);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  printf("%s: child %s\n", use_after_free ? "Use after free" : "Overflow",
+         WIFSIGNALED(status) ? "stopped by a guard page" : "was NOT stopped");
+}
+
 int main() {
+  // keep the statistics exact; guard_demo() samples in its own child process
+  pm_set_sample_rate(0);
   // initialize heap
   printf("Initializing heap...\n");
   initialize_heap();
@@ -532,8 +1029,8 @@ int main() {
   printf("Allocating 10 pages of memory...\n");
   for (int i = 0; i < 10; i++) {
     page* block = pm_malloc(i * 69 + 420);
-    printf("Allocated page %d: <%p> (size: %ld)\n", block->page_id,
-           (void*)block, block->size);
+    printf("Allocated page %d: <%p> (size: %u)\n", block->page_id,
+           (void*)block, PAGE_BYTES(block));
   }
   printf("Heap pages in use: %zu\n\n", heap_pages_in_use);
   print_allocated_statistics();
@@ -542,21 +1039,67 @@ int main() {
   printf("Allocating 10 more pages of memory...\n");
   for (int i = 0; i < 10; i++) {
     page* block = pm_malloc(i * 60 + 32);
-    printf("Allocated page %d: <%p> (size: %ld)\n", block->page_id,
-           (void*)block, block->size);
+    printf("Allocated page %d: <%p> (size: %u)\n", block->page_id,
+           (void*)block, PAGE_BYTES(block));
+  }
+  printf("Heap pages in use: %zu\n\n", heap_pages_in_use);
+  print_allocated_statistics();
+
+  printf("Testing pm_realloc and pm_calloc...\n");
+  printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
+  page* buf = pm_malloc(100);
+  strcpy(PAGE_DATA(buf), "hello heap");
+  printf("Allocated page %d: <%p> (size: %u)\n", buf->page_id, (void*)buf,
+         PAGE_BYTES(buf));
+  page* grown = pm_realloc(buf, PAGE_SIZE);
+  printf("Grew page %d to %d pages %s: <%p> (size: %u) \"%s\"\n",
+         grown->page_id, grown->span, grown == buf ? "in place" : "by copying",
+         (void*)grown, PAGE_BYTES(grown), (char*)PAGE_DATA(grown));
+  grown = pm_realloc(grown, 3 * PAGE_SIZE);
+  printf("Grew page %d to %d pages %s: <%p> (size: %u) \"%s\"\n",
+         grown->page_id, grown->span, grown == buf ? "in place" : "by copying",
+         (void*)grown, PAGE_BYTES(grown), (char*)PAGE_DATA(grown));
+  page* blocker = pm_malloc(1);  // occupy the page right after grown
+  grown = pm_realloc(grown, 4 * PAGE_SIZE);
+  printf("Grew page %d to %d pages %s: <%p> (size: %u) \"%s\"\n",
+         grown->page_id, grown->span, grown == buf ? "in place" : "by copying",
+         (void*)grown, PAGE_BYTES(grown), (char*)PAGE_DATA(grown));
+  pm_free(blocker);
+  page* zeroed = pm_calloc(2, PAGE_SIZE);
+  bool all_zero = true;
+  for (size_t i = 0; i < 2 * PAGE_SIZE; i++) {
+    all_zero = all_zero && ((char*)PAGE_DATA(zeroed))[i] == 0;
   }
+  printf("Calloc'd page %d over %d pages is %szeroed\n", zeroed->page_id,
+         zeroed->span, all_zero ? "" : "NOT ");
+
+  // consecutive objects should land in different L1 cache sets
+  for (int i = 0; i < 4; i++) {
+    page* counter =
+        pm_malloc_aligned(sizeof(long), CACHE_LINE_SIZE, PM_CACHE_ISOLATED);
+    unsigned long addr = (unsigned long)PAGE_DATA(counter);
+    printf("Isolated counter page %d: <%p> (line offset: %lu, L1 set: %lu)\n",
+           counter->page_id, PAGE_DATA(counter), addr % CACHE_LINE_SIZE,
+           addr / CACHE_LINE_SIZE % (PAGE_SIZE / CACHE_LINE_SIZE));
+  }
+  page* aligned = pm_memalign(1024, 100);
+  printf("pm_memalign(1024) page %d: <%p> (offset from alignment: %lu)\n",
+         aligned->page_id, PAGE_DATA(aligned),
+         (unsigned long)PAGE_DATA(aligned) % 1024);
+  printf("pm_memalign(3) should return NULL (0x0): %p\n",
+         (void*)pm_memalign(3, 100));
+  guard_demo(false);
+  guard_demo(true);
   printf("Heap pages in use: %zu\n\n", heap_pages_in_use);
   print_allocated_statistics();
 
   printf("Freeing heap...\n");
   printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
-  for (int i = 0; i < MAX_PAGES; i++) {
-    if (heap[i].is_free) {
-      continue;
-    }
+  for (int i = next_page(heap_free_map, 0, false); i < MAX_PAGES;
+       i = next_page(heap_free_map, i + 1, false)) {
     pm_free(&heap[i]);
-    printf("Freed page %d: <%p> (size: %ld)\n", heap[i].page_id,
-           (void*)&heap[i], heap[i].size);
+    printf("Freed page %d: <%p> (size: %u)\n", heap[i].page_id,
+           (void*)&heap[i], PAGE_BYTES(&heap[i]));
   }
   printf("Heap pages in use: %zu\n\n", heap_pages_in_use);
   print_allocated_statistics();
@@ -649,3 +1192,4 @@ int main() {
 
   return 0;
 }
+#endif  // PM_PRELOAD
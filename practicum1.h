@@ -0,0 +1,94 @@
+/**
+ * @file practicum1.h
+ * @author Edgar Alan David and Stephano Barrios-Pompei
+ * @brief Programmed managed heap interface shared by the demo program and the
+ * malloc interposition library.
+ * @version 0.1
+ * @date 2022-11-08
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef PRACTICUM1_H
+#define PRACTICUM1_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************
+ ******MACROS AND STRUCTS******
+ ******************************/
+// define start of memory and adjustment for header overhead
+#define BLOCK_DATA(ptr) ((void*)((unsigned long)ptr + sizeof(page)))
+#define BLOCK_HEADER(ptr) ((void*)((unsigned long)ptr - sizeof(page)))
+// memory backing a page in heap, or the guarded slot of a sampled allocation
+#define PAGE_FRAME(block) \
+  (IS_GUARDED(block) ? guarded_frame(block) : heap_frames[(block) - heap])
+// start of an allocation's data (after its cache colour offset)
+#define PAGE_DATA(block) \
+  ((void*)(PAGE_FRAME(block) + heap_offsets[(block) - heap]))
+// number of pages needed to hold size bytes (page metadata lives in heap[])
+#define PAGES_FOR(size) (((size) + PAGE_SIZE - 1) / PAGE_SIZE)
+// our heap is the same size as a Playstation 2 Memory Card!
+// with a 4KB page size, we can have 2048 pages
+#define HEAP_CAPACITY 8 * 1024 * 1024  // 8 MB heap
+#define PAGE_SIZE 4096                 // 4 KB page size
+#define MAX_PAGES 2048  // 2048 pages (4 KB each) fit in our heap (8 MB)
+// sampled allocations (see pm_guard.c) are described by the GUARD_SLOTS
+// descriptors that follow the MAX_PAGES heap pages in heap[]
+#define GUARD_SLOTS 64
+#define HEAP_DESCRIPTORS (MAX_PAGES + GUARD_SLOTS)
+#define IS_GUARDED(block) ((block) - heap >= MAX_PAGES)
+#define CACHE_LINE_SIZE 64
+// flags for pm_malloc_aligned
+#define PM_CACHE_ISOLATED 0x1  // object owns every cache line it touches
+// page flags are kept in bitmaps, one bit per page and 64 pages per word
+#define MAP_WORDS (MAX_PAGES / 64)
+#define MAP_TEST(map, i) (((map)[(i) / 64] >> ((i) % 64)) & 1)
+// per-page metadata of a page in heap
+#define PAGE_IS_FREE(block) MAP_TEST(heap_free_map, (block) - heap)
+#define PAGE_BYTES(block) heap_sizes[(block) - heap]
+#define PAGE_OFFSET(block) heap_offsets[(block) - heap]
+
+// Page metadata is stored as a struct of arrays so whole-heap sweeps only
+// touch the field they need: heap[] holds ids, heap_sizes[] holds sizes and
+// the flags live in the heap_*_map bitmaps.
+typedef struct page {
+  int page_id;  // unique page id
+  int span;     // pages in the allocation (0 if free or a continuation page)
+} page;
+
+/******************************
+ *******GLOBAL VARIABLES*******
+ ******************************/
+extern page heap[HEAP_DESCRIPTORS];
+extern uint32_t heap_sizes[HEAP_DESCRIPTORS];
+extern uint16_t heap_offsets[HEAP_DESCRIPTORS];
+extern uint64_t heap_free_map[MAP_WORDS];
+extern uint64_t heap_zero_map[MAP_WORDS];
+extern uint64_t heap_disk_map[MAP_WORDS];
+extern char heap_frames[MAX_PAGES][PAGE_SIZE];
+extern size_t heap_pages_in_use;
+
+/******************************
+ ***********FUNCTIONS**********
+ ******************************/
+void initialize_pages(void);
+page* pm_malloc(size_t size);
+page* pm_calloc(size_t nmemb, size_t size);
+page* pm_memalign(size_t alignment, size_t size);
+page* pm_malloc_aligned(size_t size, size_t alignment, int flags);
+page* pm_realloc(page* block, size_t size);
+void pm_free(page* block);
+
+// sampling guard-page allocator (pm_guard.c)
+void pm_set_sample_rate(unsigned long rate);
+bool guard_should_sample(void);
+page* guarded_malloc(size_t size, size_t alignment, bool zero);
+void guarded_free(page* block);
+char* guarded_frame(const page* block);
+page* guarded_block(const void* ptr);
+
+#endif  // PRACTICUM1_H